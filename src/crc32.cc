@@ -0,0 +1,147 @@
+#include "crc32.h"
+
+#include <array>
+#include <cstring>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#elif defined(__PCLMUL__) && defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+namespace vrc_photo_album2 {
+namespace {
+constexpr auto make_table() {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    table[i] = c;
+  }
+  return table;
+}
+constexpr auto crc_table = make_table();
+
+// crcは反転済みの値を受け取る
+uint32_t crc32_table(uint32_t crc, const unsigned char* buf, std::size_t len) {
+  for (std::size_t i = 0; i < len; i++) {
+    crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__ARM_FEATURE_CRC32)
+uint32_t crc32_hw(uint32_t crc, const unsigned char* buf, std::size_t len) {
+  for (; len >= 8; buf += 8, len -= 8) {
+    uint64_t v;
+    std::memcpy(&v, buf, 8);
+    crc = __crc32d(crc, v);
+  }
+  for (; len > 0; buf++, len--) {
+    crc = __crc32b(crc, *buf);
+  }
+  return crc;
+}
+#elif defined(__PCLMUL__) && defined(__SSE4_1__)
+// 64byte単位でcarry-less乗算による畳み込みをしてBarrett還元する
+// (Intel "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ")
+// len >= 64かつ16の倍数
+uint32_t crc32_pclmul(uint32_t crc, const unsigned char* buf, std::size_t len) {
+  alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+  alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+  alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+  alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+  x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x00));
+  x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x10));
+  x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x20));
+  x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+  buf += 64;
+  len -= 64;
+
+  while (len >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    y5 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x00));
+    y6 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x10));
+    y7 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x20));
+    y8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x30));
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+    buf += 64;
+    len -= 64;
+  }
+
+  // 512bit -> 128bit
+  x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+  for (__m128i x : {x2, x3, x4}) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x), x5);
+  }
+
+  while (len >= 16) {
+    x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    buf += 16;
+    len -= 16;
+  }
+
+  // 128bit -> 64bit
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+  x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett還元
+  x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return _mm_extract_epi32(x1, 1);
+}
+
+uint32_t crc32_hw(uint32_t crc, const unsigned char* buf, std::size_t len) {
+  if (len >= 64) {
+    const std::size_t simd_len = len & ~static_cast<std::size_t>(15);
+    crc = crc32_pclmul(crc, buf, simd_len);
+    buf += simd_len;
+    len -= simd_len;
+  }
+  return crc32_table(crc, buf, len);
+}
+#else
+uint32_t crc32_hw(uint32_t crc, const unsigned char* buf, std::size_t len) {
+  return crc32_table(crc, buf, len);
+}
+#endif
+} // namespace
+
+uint32_t crc32(uint32_t crc, const unsigned char* buf, std::size_t len) {
+  return ~crc32_hw(~crc, buf, len);
+}
+} // namespace vrc_photo_album2
@@ -0,0 +1,11 @@
+#ifndef VRC_PHOTO_ALBUM2_CRC32_H
+#define VRC_PHOTO_ALBUM2_CRC32_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace vrc_photo_album2 {
+// PNG/zlibと同じCRC32 crcに前回の戻り値を渡すと続きから計算する
+uint32_t crc32(uint32_t crc, const unsigned char* buf, std::size_t len);
+} // namespace vrc_photo_album2
+#endif
@@ -0,0 +1,37 @@
+#include "frame_pool.h"
+
+namespace vrc_photo_album2 {
+
+frame_pool::frame_pool(const cv::Size size, const int type) : size_(size), type_(type) {}
+
+cv::Mat frame_pool::acquire() {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!frames_.empty()) {
+      cv::Mat frame = std::move(frames_.back());
+      frames_.pop_back();
+      return frame;
+    }
+  }
+  // 中身は使う側で上書きするので初期化しない
+  return cv::Mat(size_, type_);
+}
+
+void frame_pool::release(cv::Mat& frame) {
+  // 他のMatと共有しているバッファやサイズ違いは返却せずに解放する
+  if (frame.empty() || frame.size() != size_ || frame.type() != type_ ||
+      !frame.isContinuous() || frame.u == nullptr || frame.u->refcount != 1) {
+    frame.release();
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mtx_);
+  frames_.push_back(std::move(frame));
+  frame = cv::Mat();
+}
+
+void frame_pool::release(std::vector<cv::Mat>& frames) {
+  for (auto& frame : frames) {
+    release(frame);
+  }
+}
+} // namespace vrc_photo_album2
@@ -0,0 +1,26 @@
+#ifndef VRC_PHOTO_ALBUM2_FRAME_POOL_H
+#define VRC_PHOTO_ALBUM2_FRAME_POOL_H
+
+#include <mutex>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+namespace vrc_photo_album2 {
+
+// 固定サイズのcv::Matをセグメント・スレッド間で使い回す
+class frame_pool {
+public:
+  frame_pool(const cv::Size size, const int type);
+  cv::Mat acquire();
+  void release(cv::Mat& frame);
+  void release(std::vector<cv::Mat>& frames);
+
+private:
+  std::mutex mtx_;
+  std::vector<cv::Mat> frames_;
+  cv::Size size_;
+  int type_;
+};
+} // namespace vrc_photo_album2
+#endif
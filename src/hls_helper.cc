@@ -1,4 +1,7 @@
 #include <iostream>
+#include <sstream>
+
+#include <boost/format.hpp>
 
 #include "hls_helper.h"
 #include "util.h"
@@ -60,4 +63,123 @@ bool hls_manager::compare_end(const filesystem::path path) const {
 void hls_manager::ifs_close() {
   ifs_->close();
 }
+
+void invalidate_segments(const filesystem::path& path, const std::string& date) {
+  std::ifstream ifs(path);
+  if (!ifs) {
+    return;
+  }
+  // #v%06d,start,end はセグメント順に並んでいるので一度消したら後ろも全部消す
+  std::stringstream kept;
+  std::string line;
+  bool drop = false;
+  while (std::getline(ifs, line)) {
+    if (line.starts_with("#v")) {
+      const auto end_pos = line.rfind(',');
+      drop = drop || (end_pos != std::string::npos && line.substr(end_pos + 1) >= date);
+      if (drop) {
+        continue;
+      }
+    }
+    kept << line << "\n";
+  }
+  ifs.close();
+  std::ofstream ofs(path, std::ios::trunc);
+  ofs << kept.str();
+}
+
+segment_pack::segment_pack(const filesystem::path dir, const std::string prefix,
+                           const int pack_size)
+    : dir_(dir), prefix_(prefix), pack_size_(pack_size) {
+  index_path_ = dir_.string() + prefix_ + "_pack.idx";
+  std::ifstream ifs(index_path_);
+  pack_entry entry;
+  while (ifs >> entry.pack >> entry.offset >> entry.size) {
+    // 書きかけのpackを指す行が残っていたらそこから先は使わない
+    std::error_code ec;
+    const auto pack_size = filesystem::file_size(pack_path(entry.pack), ec);
+    if (ec || entry.offset + entry.size > pack_size) {
+      break;
+    }
+    entries_.push_back(entry);
+  }
+  // 以降の追記が途切れた行に続かないように読めた分だけで書き直しておく
+  if (ifs.is_open()) {
+    ifs.close();
+    save_index();
+  }
+}
+
+void segment_pack::truncate(const int segment) {
+  if (segment < size()) {
+    entries_.resize(segment);
+  }
+
+  // segmentより後ろの中身を切り詰めて以降のpackは消す
+  // 中断された実行でindexより後ろに書かれたデータもここで捨てる
+  const int pack = size() / pack_size_;
+  if (size() % pack_size_ != 0) {
+    const auto& last = entries_.back();
+    filesystem::resize_file(pack_path(pack), last.offset + last.size);
+  } else {
+    filesystem::remove(pack_path(pack));
+  }
+  for (int i = pack + 1; filesystem::exists(pack_path(i)); i++) {
+    filesystem::remove(pack_path(i));
+  }
+  save_index();
+}
+
+void segment_pack::append(const int segment, const filesystem::path& ts) {
+  if (segment != size()) {
+    throw std::invalid_argument("segment_pack: segment must be appended in order.");
+  }
+  const int pack              = segment / pack_size_;
+  const filesystem::path path = pack_path(pack);
+  pack_entry entry{pack, 0, filesystem::file_size(ts)};
+  if (segment % pack_size_ != 0) {
+    entry.offset = entries_.back().offset + entries_.back().size;
+  }
+
+  std::ios::openmode mode = std::ios::binary | std::ios::trunc;
+  if (entry.offset != 0) {
+    // 前回の書き込みが途中で止まっていてもindexの位置から書く
+    filesystem::resize_file(path, entry.offset);
+    mode = std::ios::binary | std::ios::app;
+  }
+  std::ifstream ifs(ts, std::ios::binary);
+  std::ofstream ofs(path, mode);
+  ofs << ifs.rdbuf();
+  ofs.close();
+  if (!ofs) {
+    throw std::runtime_error("segment_pack: write failed " + path.string());
+  }
+
+  entries_.push_back(entry);
+  std::ofstream index(index_path_, std::ios::app);
+  index << entry.pack << " " << entry.offset << " " << entry.size << "\n";
+}
+
+std::string segment_pack::pack_name(const int pack) const {
+  return (boost::format("%s_pack_%03d.ts") % prefix_ % pack).str();
+}
+
+const pack_entry& segment_pack::entry(const int segment) const {
+  return entries_.at(segment);
+}
+
+int segment_pack::size() const {
+  return entries_.size();
+}
+
+filesystem::path segment_pack::pack_path(const int pack) const {
+  return dir_.string() + pack_name(pack);
+}
+
+void segment_pack::save_index() const {
+  std::ofstream ofs(index_path_, std::ios::trunc);
+  for (auto& entry : entries_) {
+    ofs << entry.pack << " " << entry.offset << " " << entry.size << "\n";
+  }
+}
 } // namespace vrc_photo_album2
@@ -5,6 +5,7 @@
 #include <memory>
 #include <fstream>
 #include <string>
+#include <vector>
 
 namespace vrc_photo_album2 {
 namespace filesystem = std::filesystem;
@@ -32,6 +33,38 @@ private:
   std::shared_ptr<std::ifstream> ifs_;
   const std::string m3index_tag = "#v";
 };
+
+// m3u8やtmpファイルの#v行からdate以降の写真を含むセグメントを消して次回作り直させる
+void invalidate_segments(const filesystem::path& path, const std::string& date);
+
+struct pack_entry {
+  int pack;
+  std::uintmax_t offset;
+  std::uintmax_t size;
+};
+
+// セグメントのtsを大きいファイルに連結してEXT-X-BYTERANGEで参照する
+// 連結先と位置はprefix_pack.idxに1セグメント1行で追記していく
+class segment_pack {
+public:
+  segment_pack(const filesystem::path dir, const std::string prefix,
+               const int pack_size = 1024);
+  void truncate(const int segment);
+  void append(const int segment, const filesystem::path& ts);
+  std::string pack_name(const int pack) const;
+  const pack_entry& entry(const int segment) const;
+  int size() const;
+
+private:
+  filesystem::path pack_path(const int pack) const;
+  void save_index() const;
+
+  filesystem::path dir_;
+  std::string prefix_;
+  int pack_size_;
+  filesystem::path index_path_;
+  std::vector<pack_entry> entries_;
+};
 } // namespace vrc_photo_album2
 
 #endif
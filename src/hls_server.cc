@@ -0,0 +1,289 @@
+#include "hls_server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <boost/format.hpp>
+
+namespace vrc_photo_album2 {
+namespace {
+bool send_all(int fd, const char* data, std::size_t size) {
+  while (size > 0) {
+    const ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+std::string content_type(const std::string& name) {
+  if (name.ends_with(".m3u8")) {
+    return "application/vnd.apple.mpegurl";
+  }
+  if (name.ends_with(".ts")) {
+    return "video/mp2t";
+  }
+  return "application/octet-stream";
+}
+
+std::shared_ptr<const std::string> read_all(const filesystem::path& path) {
+  std::ifstream ifs(path, std::ios::binary);
+  if (!ifs) {
+    return nullptr;
+  }
+  return std::make_shared<const std::string>(std::istreambuf_iterator<char>(ifs),
+                                             std::istreambuf_iterator<char>());
+}
+} // namespace
+
+hls_server::hls_server(const filesystem::path root, const std::string file_pref,
+                       const int segment_num, std::function<void(int)> render,
+                       const int prefetch, const std::size_t cache_bytes)
+    : root_(root),
+      segment_prefix_("_" + file_pref + "_"),
+      segment_num_(segment_num),
+      render_(render),
+      prefetch_(prefetch),
+      cache_bytes_(cache_bytes) {
+  prefetch_thread_ = std::thread(&hls_server::prefetch_worker, this);
+}
+
+hls_server::~hls_server() {
+  {
+    std::lock_guard<std::mutex> lock(prefetch_mtx_);
+    stop_ = true;
+  }
+  prefetch_cv_.notify_all();
+  prefetch_thread_.join();
+}
+
+void hls_server::serve(const std::string address, const int port) {
+  const int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    throw std::runtime_error("socket failed.");
+  }
+  const int reuse = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port   = htons(port);
+  if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+    close(sock);
+    throw std::invalid_argument("invalid bind address: " + address);
+  }
+  if (bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(sock, 64) < 0) {
+    close(sock);
+    throw std::runtime_error("bind failed: " + address + ":" + std::to_string(port));
+  }
+  std::cout << "serving " << root_ << " on http://" << address << ":" << port << "/"
+            << std::endl;
+
+  for (;;) {
+    const int fd = accept(sock, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    std::thread(&hls_server::handle, this, fd).detach();
+  }
+}
+
+void hls_server::handle(int fd) {
+  std::string request;
+  char buf[4096];
+  while (request.find("\r\n\r\n") == std::string::npos && request.size() < 16384) {
+    const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) {
+      break;
+    }
+    request.append(buf, n);
+  }
+
+  std::string method, target;
+  std::istringstream(request) >> method >> target;
+
+  // video_dir直下のファイルだけ返す
+  std::string name = target.substr(0, target.find('?'));
+  if (name.starts_with("/")) {
+    name.erase(0, 1);
+  }
+  int status = 404;
+  body_ptr body;
+  if (method != "GET" && method != "HEAD") {
+    status = 405;
+  } else if (!name.empty() && name.find('/') == std::string::npos &&
+             name.find("..") == std::string::npos) {
+    try {
+      if (auto segment = parse_segment(name)) {
+        auto& [quality, i] = *segment;
+        body               = load_segment(name, i);
+        schedule_prefetch(quality, i);
+      } else {
+        body = read_all(root_ / name);
+      }
+      if (body) {
+        status = 200;
+      }
+    } catch (std::exception& e) {
+      // 生成に失敗しても他の接続は続けて捌く
+      std::cout << "request exception: " << name << " " << e.what() << std::endl;
+      status = 500;
+      body   = nullptr;
+    }
+  }
+
+  const std::string reason = status == 200   ? "OK"
+                             : status == 405 ? "Method Not Allowed"
+                             : status == 500 ? "Internal Server Error"
+                                             : "Not Found";
+  const std::string header =
+      (boost::format("HTTP/1.1 %d %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %d\r\n"
+                     "Access-Control-Allow-Origin: *\r\n"
+                     "Connection: close\r\n\r\n") %
+       status % reason % content_type(name) % (body ? body->size() : 0))
+          .str();
+  if (send_all(fd, header.data(), header.size()) && body && method == "GET") {
+    send_all(fd, body->data(), body->size());
+  }
+  close(fd);
+}
+
+std::optional<std::pair<std::string, int>> hls_server::parse_segment(
+    const std::string& name) const {
+  // _prefix_quality_iiiiii_0.ts
+  const std::string suffix = "_0.ts";
+  if (!name.starts_with(segment_prefix_) || !name.ends_with(suffix)) {
+    return std::nullopt;
+  }
+  const std::string body =
+      name.substr(segment_prefix_.size(), name.size() - segment_prefix_.size() - suffix.size());
+  const auto pos = body.rfind('_');
+  if (pos == std::string::npos || pos == 0 || body.size() - pos - 1 != 6 ||
+      body.find_first_not_of("0123456789", pos + 1) != std::string::npos) {
+    return std::nullopt;
+  }
+  const int i = std::stoi(body.substr(pos + 1));
+  if (i >= segment_num_) {
+    return std::nullopt;
+  }
+  return std::make_pair(body.substr(0, pos), i);
+}
+
+std::string hls_server::segment_name(const std::string& quality, const int i) const {
+  return (boost::format("%s%s_%06d_0.ts") % segment_prefix_ % quality % i).str();
+}
+
+bool hls_server::ensure(const std::string& name, const int i) {
+  // tsは書き終わってから置き換えられるのであれば完成している
+  if (filesystem::exists(root_ / name)) {
+    return true;
+  }
+  std::unique_lock<std::mutex> lock(render_mtx_);
+  // 同じセグメントを二重に生成せず、生成中なら終わるのを待つ
+  render_cv_.wait(lock, [&] { return !rendering_.contains(i); });
+  if (filesystem::exists(root_ / name)) {
+    return true;
+  }
+  rendering_.insert(i);
+  lock.unlock();
+
+  std::cout << "render segment " << i << std::endl;
+  try {
+    render_(i);
+  } catch (...) {
+    lock.lock();
+    rendering_.erase(i);
+    render_cv_.notify_all();
+    throw;
+  }
+
+  lock.lock();
+  rendering_.erase(i);
+  render_cv_.notify_all();
+  return filesystem::exists(root_ / name);
+}
+
+hls_server::body_ptr hls_server::load_segment(const std::string& name, const int i) {
+  if (auto body = cache_get(name)) {
+    return body;
+  }
+  if (!ensure(name, i)) {
+    return nullptr;
+  }
+  auto body = read_all(root_ / name);
+  if (body) {
+    cache_put(name, body);
+  }
+  return body;
+}
+
+void hls_server::schedule_prefetch(const std::string& quality, const int i) {
+  // プレイリストは新しい順なので再生が進むとiが小さくなる
+  {
+    std::lock_guard<std::mutex> lock(prefetch_mtx_);
+    prefetch_queue_.clear();
+    for (int k = 1; k <= prefetch_ && i - k >= 0; k++) {
+      prefetch_queue_.emplace_back(quality, i - k);
+    }
+  }
+  prefetch_cv_.notify_all();
+}
+
+void hls_server::prefetch_worker() {
+  for (;;) {
+    std::pair<std::string, int> target;
+    {
+      std::unique_lock<std::mutex> lock(prefetch_mtx_);
+      prefetch_cv_.wait(lock, [&] { return stop_ || !prefetch_queue_.empty(); });
+      if (stop_) {
+        return;
+      }
+      target = prefetch_queue_.front();
+      prefetch_queue_.pop_front();
+    }
+    auto& [quality, i] = target;
+    try {
+      load_segment(segment_name(quality, i), i);
+    } catch (std::exception& e) {
+      std::cout << "prefetch exception: segment " << i << " " << e.what() << std::endl;
+    }
+  }
+}
+
+hls_server::body_ptr hls_server::cache_get(const std::string& name) {
+  std::lock_guard<std::mutex> lock(cache_mtx_);
+  auto it = index_.find(name);
+  if (it == index_.end()) {
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return it->second->second;
+}
+
+void hls_server::cache_put(const std::string& name, body_ptr body) {
+  std::lock_guard<std::mutex> lock(cache_mtx_);
+  if (index_.contains(name) || body->size() > cache_bytes_) {
+    return;
+  }
+  lru_.emplace_front(name, body);
+  index_[name] = lru_.begin();
+  cached_bytes_ += body->size();
+  while (cached_bytes_ > cache_bytes_) {
+    cached_bytes_ -= lru_.back().second->size();
+    index_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+}
+} // namespace vrc_photo_album2
@@ -0,0 +1,68 @@
+#ifndef VRC_PHOTO_ALBUM2_HLS_SERVER_H
+#define VRC_PHOTO_ALBUM2_HLS_SERVER_H
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+namespace vrc_photo_album2 {
+namespace filesystem = std::filesystem;
+
+// video_dirをそのままHTTPで配信し、まだ無いセグメントのtsは要求されたときに生成する
+// 生成したtsはメモリ上にもLRUで持ち、再生位置の先のセグメントを裏で生成しておく
+class hls_server {
+public:
+  hls_server(const filesystem::path root, const std::string file_pref, const int segment_num,
+             std::function<void(int)> render, const int prefetch,
+             const std::size_t cache_bytes);
+  ~hls_server();
+  void serve(const std::string address, const int port);
+
+private:
+  using body_ptr = std::shared_ptr<const std::string>;
+
+  void handle(int fd);
+  std::optional<std::pair<std::string, int>> parse_segment(const std::string& name) const;
+  std::string segment_name(const std::string& quality, const int i) const;
+  bool ensure(const std::string& name, const int i);
+  body_ptr load_segment(const std::string& name, const int i);
+  void schedule_prefetch(const std::string& quality, const int i);
+  void prefetch_worker();
+  body_ptr cache_get(const std::string& name);
+  void cache_put(const std::string& name, body_ptr body);
+
+  const filesystem::path root_;
+  const std::string segment_prefix_;
+  const int segment_num_;
+  std::function<void(int)> render_;
+  const int prefetch_;
+  const std::size_t cache_bytes_;
+
+  // 生成中のセグメント番号 終わるまで他の要求は待たせる
+  std::mutex render_mtx_;
+  std::condition_variable render_cv_;
+  std::set<int> rendering_;
+
+  std::mutex cache_mtx_;
+  std::size_t cached_bytes_ = 0;
+  std::list<std::pair<std::string, body_ptr>> lru_;
+  std::unordered_map<std::string, std::list<std::pair<std::string, body_ptr>>::iterator> index_;
+
+  std::mutex prefetch_mtx_;
+  std::condition_variable prefetch_cv_;
+  std::deque<std::pair<std::string, int>> prefetch_queue_;
+  bool stop_ = false;
+  std::thread prefetch_thread_;
+};
+} // namespace vrc_photo_album2
+#endif
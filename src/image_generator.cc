@@ -21,29 +21,53 @@ image_generator::image_generator(const cv::Size output_size, const filesystem::p
 
 void image_generator::generate_single(const filesystem::path& path, const cv::Mat& src,
                                       cv::Mat& dst) {
-  dst = cv::Mat::zeros(output_size_, CV_8UC3);
+  // dstがプールから来た同サイズのバッファなら再確保しない
+  dst.create(output_size_, CV_8UC3);
   meta_tool::meta_tool metadata;
   metadata.read(path);
 
-  double scale = (static_cast<double>(dst.rows) / src.rows);
-  int dx       = (dst.cols - src.cols * scale) / 2;
-  if (metadata.has_any()) {
+  double scale            = (static_cast<double>(dst.rows) / src.rows);
+  int dx                  = (dst.cols - src.cols * scale) / 2;
+  const bool has_metadata = metadata.has_any();
+  if (has_metadata) {
     scale *= picture_ratio_;
     dx *= picture_ratio_;
-    put_metadata(metadata, dst);
   } else if (src.size() == dst.size()) {
     // メタデータなしで同じサイズの画像
-    dst = src.clone();
+    src.copyTo(dst);
     return;
   }
 
-  cv::Mat affine = (cv::Mat_<double>(2, 3) << scale, 0, dx, 0, scale, 0);
-  cv::warpAffine(src, dst, affine, dst.size(), cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+  const cv::Rect picture(dx, 0, cvRound(src.cols * scale), cvRound(src.rows * scale));
+  if (picture.empty() || (picture & cv::Rect(cv::Point(), dst.size())) != picture) {
+    // 横長すぎてはみ出す画像は全体を消してからアフィン変換で切り取る
+    dst.setTo(cv::Scalar::all(0));
+    if (has_metadata) {
+      put_metadata(metadata, dst);
+    }
+    cv::Mat affine = (cv::Mat_<double>(2, 3) << scale, 0, dx, 0, scale, 0);
+    cv::warpAffine(src, dst, affine, dst.size(), cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+    return;
+  }
+
+  // 絵の外側(左右の余白と下のメタデータ欄)だけ消して、絵は出力先へ直接縮小する
+  // 文字が絵にかかった部分は今まで通り絵で上書きされる
+  dst(cv::Rect(0, 0, picture.x, dst.rows)).setTo(cv::Scalar::all(0));
+  dst(cv::Rect(picture.br().x, 0, dst.cols - picture.br().x, dst.rows))
+      .setTo(cv::Scalar::all(0));
+  dst(cv::Rect(picture.x, picture.br().y, picture.width, dst.rows - picture.br().y))
+      .setTo(cv::Scalar::all(0));
+  if (has_metadata) {
+    put_metadata(metadata, dst);
+  }
+  cv::Mat roi = dst(picture);
+  cv::resize(src, roi, picture.size(), 0, 0, cv::INTER_LINEAR);
 }
 
-void image_generator::generate_tile(const std::vector<filesystem::path>::iterator path,
+void image_generator::generate_tile(const std::vector<filesystem::path>::const_iterator path,
                                     const std::vector<cv::Mat>& images, cv::Mat& dst) {
-  dst = cv::Mat::zeros(output_size_, CV_8UC3);
+  dst.create(output_size_, CV_8UC3);
+  dst.setTo(cv::Scalar::all(0));
 
   const int tile_width = 3;
   const int dx         = output_size_.width / tile_width;
@@ -90,14 +114,15 @@ void image_generator::put_metadata(meta_tool::meta_tool& metadata, cv::Mat& dst)
   }
   if (metadata.has_users()) {
     int i = 0;
-    const int user_size = metadata.users().size();
+    const int user_size = metadata.user_count();
     double font_size = user_font_size_;
     if(user_size > 24){
       font_size *= 24.0 / static_cast<double>(user_size);
     }
-    for (auto [user_name, screen_name] : metadata.users()) {
-      freetype2_->putText(dst, user_name, user_pos + cv::Point(0, font_size * i++),
-                          font_size, text_color_, thickness_ / 2, cv::LINE_AA, false);
+    for (auto user = metadata.users_begin(); user != metadata.users_end(); user++) {
+      freetype2_->putText(dst, std::string(user->name),
+                          user_pos + cv::Point(0, font_size * i++), font_size, text_color_,
+                          thickness_ / 2, cv::LINE_AA, false);
     }
   }
 }
@@ -4,6 +4,7 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <set>
 
 #include <boost/format.hpp>
@@ -12,7 +13,10 @@
 #include <opencv2/imgcodecs.hpp>
 
 #include "hls_helper.h"
-#include "image_generator.h"
+#include "hls_server.h"
+#include "meta_editor.h"
+#include "photo_dedup.h"
+#include "segment_renderer.h"
 #include "util.h"
 #include "vrc_meta_tool.h"
 
@@ -27,9 +31,27 @@ auto main(int argc, char** argv) -> int {
       "{font|/usr/share/fonts/TTF/migu-1c-regular.ttf|font path}"
       "{modified|.|check modified dir}"
       "{filepref|vrc_photo_album|file prefix}"
-      "{generate_half| |enable generate half size}");
+      "{generate_half| |enable generate half size}"
+      "{prefetch|2|number of segments to read ahead}"
+      "{prefetch_mb|256|read ahead buffer size (MB)}"
+      "{retag| |rewrite png metadata from edit list file and exit}"
+      "{byterange| |pack segments into large files and use EXT-X-BYTERANGE playlists}"
+      "{dedup| |collapse near-duplicate burst shots}"
+      "{dedup_window|2|dedup time window (sec)}"
+      "{dedup_threshold|6|dedup hash hamming distance}"
+      "{serve| |serve hls on the given port and render segments on demand}"
+      "{bind|127.0.0.1|serve bind address}"
+      "{cache_mb|512|serve memory cache size (MB)}"
+      "{raw_yuv| |pass frames to ffmpeg as raw yuv420p instead of png}");
 
   const bool generate_half = parser.has("generate_half");
+  const bool serve         = parser.has("serve");
+  // 遅延生成はセグメント単位のファイルが前提なのでbyterangeとは併用しない
+  const bool byterange     = parser.has("byterange") && !serve;
+  const bool dedup         = parser.has("dedup");
+  const int prefetch       = std::max(parser.get<int>("prefetch"), 0);
+  const std::size_t prefetch_bytes =
+      static_cast<std::size_t>(std::max(parser.get<int>("prefetch_mb"), 1)) << 20;
   const cv::Size output_size(1920, 1080);
   const filesystem::path font_path(parser.get<std::string>("font"));
   const filesystem::path input_dir(parser.get<std::string>("input"));
@@ -40,6 +62,7 @@ auto main(int argc, char** argv) -> int {
   const filesystem::path check_modified_dir(input_dir.string() + "/" +
                                             parser.get<std::string>("modified"));
   const std::string file_pref(parser.get<std::string>("filepref"));
+
   const filesystem::path m3u8_file(file_pref + ".m3u8");
   std::cout << "input_dir: " << input_dir << ", output_dir: " << out_dir
             << ", modified_dir: " << check_modified_dir << ", m3u8_file: " << m3u8_file
@@ -50,6 +73,22 @@ auto main(int argc, char** argv) -> int {
   filesystem::path video_file = video_dir.string() + m3u8_file.string();
   filesystem::path tmp_file   = tmp_dir.string() + m3u8_file.string();
 
+  // メタデータの一括書き換えのみ
+  if (parser.has("retag")) {
+    std::vector<filesystem::path> retagged;
+    const int failed = meta_tool::retag(input_dir, parser.get<std::string>("retag"), retagged);
+    // 先頭と末尾のファイル名しか比較しないので、書き換えた写真を含むセグメントから後ろは
+    // 生成済みの記録を消して次回の実行で作り直させる
+    if (!retagged.empty()) {
+      const auto first = std::min_element(
+          retagged.begin(), retagged.end(),
+          [](auto& a, auto& b) { return a.filename() < b.filename(); });
+      invalidate_segments(video_file, filename_date(*first));
+      invalidate_segments(tmp_file, filename_date(*first));
+    }
+    return failed == 0 ? 0 : 1;
+  }
+
   std::vector<std::tuple<std::string, std::string>> generate_sizes;
   generate_sizes.push_back(std::make_tuple(
       "full", (boost::format("%dx%d") % output_size.width % output_size.height).str()));
@@ -100,7 +139,9 @@ auto main(int argc, char** argv) -> int {
                 << " checker time: " << std::put_time(&checker_tm, "%c") << std::endl;
       if (input_time == checker_time) {
         std::cout << "inputdir not changed!" << std::endl;
-        return 0;
+        if (!serve) {
+          return 0;
+        }
       } else {
         std::cout << "inputdir changed!" << std::endl;
       }
@@ -127,6 +168,20 @@ auto main(int argc, char** argv) -> int {
               << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
               << std::endl;
 
+    // 連写の重複除去
+    if (dedup) {
+      start = std::chrono::system_clock::now();
+      photo_dedup deduplicator(video_dir.string() + file_pref + ".dedup",
+                               parser.get<double>("dedup_window"),
+                               parser.get<int>("dedup_threshold"));
+      deduplicator.collapse(resource_paths);
+      deduplicator.save();
+      end = std::chrono::system_clock::now();
+      std::cout << "dedup time:"
+                << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+                << std::endl;
+    }
+
     // 重複チェック
     start = std::chrono::system_clock::now();
     hls_manager manager(*read_meta_file);
@@ -155,106 +210,83 @@ auto main(int argc, char** argv) -> int {
               << std::endl;
 
     // ファイルの更新なしの場合
-    if (update_index >= segment_num) {
+    if (update_index >= segment_num && !serve) {
       std::cout << "file not changed" << std::endl;
       filesystem::last_write_time(video_file, input_time);
       filesystem::last_write_time(tmp_file, input_time);
       return 0;
     }
 
-    std::cout << "update from " << update_index << " th block" << std::endl;
-
-    // fontをtmpfsへコピー
-    const filesystem::path tmp_font = tmp_dir.string() + font_path.filename().string();
-    std::cout << "copy" << font_path << " -> " << tmp_font << std::endl;
-    filesystem::copy_file(font_path, tmp_font, filesystem::copy_options::update_existing);
-
-    const filesystem::path blank_path = "./blank.png";
-    const cv::Mat blank_image         = cv::imread(blank_path);
-
-    // 画像生成部分
-    // ここを消すと内側が並列化されるので1ブロック生成時は消すと良い（いい方法ない？）
-    // #pragma omp parallel for
-    for (int i = update_index; i < segment_num; i++) {
-      const int index = i * tile_size;
-      auto it         = std::next(resource_paths.begin(), index);
-      int bound       = bound_load(it, resource_paths.end(), tile_size);
-      std::vector<cv::Mat> images(bound);
-      std::vector<cv::Mat> dsts(tile_size + 1);
-#pragma omp parallel for
-      for (int j = 0; j < bound; j++) {
-        images[j] = cv::imread(*(std::next(it, j)));
-      }
-      image_generator generator(output_size, tmp_font);
-      generator.generate_tile(it, images, dsts[0]);
-
-#pragma omp parallel for
-      for (int j = 0; j < bound; j++) {
-        auto id = std::next(it, j);
-        image_generator generator(output_size, tmp_font);
-        // tile_size - jで新しいファイルからjで昔のファイルから (1)
-        generator.generate_single(*id, images[j], dsts[(tile_size - 1) - j + 1]);
-        // std::string log(std::string("") + "generate: " + output_dir.string() +
-        //                 id->filename().string() + " -> " + output_dir.string() +
-        //                 (boost::format("img-%05d_%05d.png") % i % (j + 1)).str());
-        // std::cout << log << std::endl;
+    // byterange出力のときはqualityごとに連結先を用意する
+    std::map<std::string, segment_pack> packs;
+    if (byterange) {
+      for (auto& [quality, size] : generate_sizes) {
+        auto& pack = packs.try_emplace(quality, video_dir, "_" + file_pref + "_" + quality)
+                         .first->second;
+        // 既存のtsがあれば作り直さずに取り込み、セグメントごとのm3u8も消す
+        for (int i = pack.size(); i < update_index; i++) {
+          const std::string segment =
+              video_dir.string() +
+              (boost::format("_%s_%s_%06d") % file_pref % quality % i).str();
+          if (!filesystem::exists(segment + "_0.ts")) {
+            update_index = i;
+            break;
+          }
+          pack.append(i, segment + "_0.ts");
+          filesystem::remove(segment + "_0.ts");
+          filesystem::remove(segment + ".m3u8");
+        }
       }
-      // for (int j = bound + 1; j < dsts.size(); j++) {
-      for (int j = bound + 1; j < dsts.size(); j++) {
-        // tile_size - jで新しいファイルからjで昔のファイルから (2)
-        dsts[tile_size - j + 1] = blank_image;
+      for (auto& [quality, pack] : packs) {
+        update_index = std::min(update_index, pack.size());
       }
-
-#pragma omp parallel for
-      for (int j = 0; j < dsts.size(); j++) {
-        cv::imwrite(
-            (boost::format("%s_%s%06d_%05d.png") % output_dir.string() % file_pref % i % (j))
-                .str(),
-            dsts[j]);
-        dsts[j].release();
-      }
-
-      // 10枚毎のブロック生成部分
-      for (auto& [quality, size] : generate_sizes) {
-        std::string command =
-            (boost::format("ffmpeg -loglevel error -framerate 1 "
-                           "-i %s_%s%06d_%s.png -vcodec libx264 "
-                           "-pix_fmt yuv420p -r 5 -f hls -hls_time 10 "
-                           "-hls_playlist_type vod -hls_segment_filename "
-                           "\"%s_%s_%s_%06d_%s.ts\" -s %s %s_%s_%s_%06d.m3u8") %
-             output_dir.string() % file_pref % i % "%05d" % video_dir.string() %
-             file_pref % quality % i % "%1d" % size % video_dir.string() % file_pref % quality % i)
-                .str();
-        std::cout << command << std::endl;
-        std::system(command.c_str());
+      for (auto& [quality, pack] : packs) {
+        pack.truncate(update_index);
       }
     }
 
     // hlsのメタデータ変更部分
-    auto generate_metadata = [&](std::string quality) {
+    // countより前のセグメントをプレイリストに載せ、そのうちtsが揃っているindexed個だけを
+    // 生成済みとして記録する。全部揃うまでは更新日時を揃えず次回の実行で続きを作らせる
+    auto generate_metadata = [&](std::string quality, const int count, const int indexed) {
       std::cout << "writeing m3u8 " << quality << std::endl;
-      const std::string m3head = {
-          "#EXTM3U\n"
-          "#EXT-X-VERSION:3\n"
-          "#EXT-X-TARGETDURATION:10\n"
-          "#EXT-X-MEDIA-SEQUENCE:0\n"
-          "#EXT-X-PLAYLIST-TYPE:EVENT\n\n"};
+      // EXT-X-BYTERANGEはversion 4から
+      const std::string m3head = (boost::format("#EXTM3U\n"
+                                                "#EXT-X-VERSION:%d\n"
+                                                "#EXT-X-TARGETDURATION:10\n"
+                                                "#EXT-X-MEDIA-SEQUENCE:0\n"
+                                                "#EXT-X-PLAYLIST-TYPE:EVENT\n\n") %
+                                  (byterange ? 4 : 3))
+                                     .str();
       const std::string m3tail = {"#EXT-X-ENDLIST\n"};
       std::stringstream m3stream;
       std::stringstream m3index;
       auto path                = resource_paths.begin();
       constexpr int block_size = 180;
-      const int block_num      = (segment_num + block_size - 1) / block_size;
+      const int block_num      = (count + block_size - 1) / block_size;
       std::vector<std::stringstream> m3block(block_num);
-      for (int i = 0; i < segment_num; i++, std::advance(path, tile_size)) {
+      for (int i = 0; i < count; i++, std::advance(path, tile_size)) {
         auto end = std::next(path, bound_load(path, resource_paths.end(), tile_size) - 1);
-        m3index << boost::format("#v%06d,%s,%s\n") % i % filename_date(*path) %
-                       filename_date(*end);
-        std::string segment_data = (boost::format("#EXT-X-DISCONTINUITY\n"
-                                                  "#EXTINF:10\n"
-                                                  "_%s_%s_%06d_%01d.ts\n") %
-                                    file_pref % quality % (segment_num - i - 1) % 0)
-                                       .str();
+        if (i < indexed) {
+          m3index << boost::format("#v%06d,%s,%s\n") % i % filename_date(*path) %
+                         filename_date(*end);
+        }
+        std::string segment_data;
+        if (byterange) {
+          const pack_entry& entry = packs.at(quality).entry(count - i - 1);
+          segment_data            = (boost::format("#EXT-X-DISCONTINUITY\n"
+                                                   "#EXTINF:10\n"
+                                                   "#EXT-X-BYTERANGE:%d@%d\n"
+                                                   "%s\n") %
+                          entry.size % entry.offset % packs.at(quality).pack_name(entry.pack))
+                             .str();
+        } else {
+          segment_data = (boost::format("#EXT-X-DISCONTINUITY\n"
+                                        "#EXTINF:10\n"
+                                        "_%s_%s_%06d_%01d.ts\n") %
+                          file_pref % quality % (count - i - 1) % 0)
+                             .str();
+        }
         m3stream << segment_data;
         m3block[i / block_size] << segment_data;
       }
@@ -268,10 +300,13 @@ auto main(int argc, char** argv) -> int {
         ofs.close();
       }
       // block_sizeごとに分けたm3u8
+      auto block_file = [&](const int i) {
+        return video_dir.string() +
+               (boost::format("%s_%s_%03d.m3u8") % file_pref % quality % i).str();
+      };
 #pragma omp parallel for
       for (int i = 0; i < block_num; i++) {
-        std::ofstream ofs(video_dir.string() +
-                          (boost::format("%s_%s_%03d.m3u8") % file_pref % quality % i).str());
+        std::ofstream ofs(block_file(i));
         for (int j = block_num - 1 - i; j > 0; j--) {
           m3block[i] << "#EXT-X-DISCONTINUITY\n"
                         "#EXTINF:10\n"
@@ -280,6 +315,9 @@ auto main(int argc, char** argv) -> int {
         ofs << m3head << m3block[i].str() << m3tail;
         ofs.close();
       }
+      // 前回よりブロックが減ったときの残りは消したtsや切り詰めたpackを指しているので消す
+      for (int i = block_num; filesystem::remove(block_file(i)); i++) {
+      }
 
       // tmpファイル書き込み
       ofs = std::ofstream(tmp_file);
@@ -290,18 +328,96 @@ auto main(int argc, char** argv) -> int {
                 << std::endl;
       ofs.close();
 
-      filesystem::last_write_time(video_file, input_time);
-      filesystem::last_write_time(tmp_file, input_time);
+      if (indexed >= segment_num) {
+        filesystem::last_write_time(video_file, input_time);
+        filesystem::last_write_time(tmp_file, input_time);
+      }
     };
 
+    // 切り詰めたpackを古いプレイリストが参照しないように残った分だけで書き直す
+    if (byterange) {
+      for (auto& [quality, size] : generate_sizes) {
+        generate_metadata(quality, update_index, update_index);
+      }
+    }
+
+    std::cout << "update from " << update_index << " th block" << std::endl;
+
+    // fontをtmpfsへコピー
+    const filesystem::path tmp_font = tmp_dir.string() + font_path.filename().string();
+    std::cout << "copy" << font_path << " -> " << tmp_font << std::endl;
+    filesystem::copy_file(font_path, tmp_font, filesystem::copy_options::update_existing);
+
+    segment_renderer renderer(resource_paths, tile_size, output_size, tmp_font, output_dir,
+                              video_dir, file_pref, generate_sizes, prefetch_bytes,
+                              parser.has("raw_yuv"));
+
+    if (serve) {
+      // 変更のあったセグメントは消しておき、要求されたときに作り直す
+      for (int i = update_index; i < segment_num; i++) {
+        for (auto& [quality, size] : generate_sizes) {
+          filesystem::remove(renderer.segment_path(quality, i) + "_0.ts");
+        }
+      }
+    } else {
+      // 画像読み込みをエンコードと重ねるため先のセグメントを先読みする
+      for (int i = update_index; i <= update_index + prefetch; i++) {
+        renderer.request(i);
+      }
+      // 途中経過のプレイリストは全体を書き直すので毎セグメントではなく間隔を空ける
+      // indexがpackより遅れていても次回の実行でpackの方をindexに合わせて切り詰める
+      constexpr int playlist_interval = 180;
+      // 画像生成部分
+      for (int i = update_index; i < segment_num; i++) {
+        renderer.request(i + prefetch + 1);
+        const bool rendered = renderer.render(i);
+
+        if (byterange) {
+          // packは順番に積むので途中のセグメントが欠けたらそこで止める
+          bool packed = rendered;
+          for (auto& [quality, size] : generate_sizes) {
+            const std::string segment = renderer.segment_path(quality, i);
+            packed = packed && filesystem::exists(segment + "_0.ts");
+          }
+          if (!packed) {
+            std::cout << "segment " << i << " failed, stop at " << i << " th block"
+                      << std::endl;
+            return 1;
+          }
+          for (auto& [quality, size] : generate_sizes) {
+            const std::string segment = renderer.segment_path(quality, i);
+            packs.at(quality).append(i, segment + "_0.ts");
+            filesystem::remove(segment + "_0.ts");
+            filesystem::remove(segment + ".m3u8");
+          }
+          // 途中で止まっても書き出した分までは再生できるようにする
+          if ((i + 1) % playlist_interval == 0) {
+            for (auto& [quality, size] : generate_sizes) {
+              generate_metadata(quality, i + 1, i + 1);
+            }
+          }
+        }
+      }
+    }
+
+    // serveでは変更のあったセグメントはまだ無いので、次のバッチ実行で作り直せるようにする
+    const int indexed = serve ? update_index : segment_num;
     std::vector<std::thread> threads;
     for (auto& [quality, size] : generate_sizes) {
-      threads.push_back(std::thread(generate_metadata, quality));
+      threads.push_back(std::thread(generate_metadata, quality, segment_num, indexed));
     }
     for (auto& elem : threads) {
       elem.join();
     }
 
     std::cout << "complete!" << std::endl;
+
+    if (serve) {
+      hls_server server(video_dir, file_pref, segment_num,
+                        [&](int i) { renderer.render(i); }, std::max(prefetch, 1),
+                        static_cast<std::size_t>(std::max(parser.get<int>("cache_mb"), 1))
+                            << 20);
+      server.serve(parser.get<std::string>("bind"), parser.get<int>("serve"));
+    }
   }
 }
@@ -0,0 +1,108 @@
+#include "meta_editor.h"
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "vrc_meta_tool.h"
+
+namespace vrc_photo_album2::meta_tool {
+namespace {
+struct edit {
+  std::string command;
+  std::string value;
+};
+
+std::optional<std::string> optional_value(const std::string& value) {
+  if (value.empty()) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+bool apply(meta_tool& metadata, const edit& e) {
+  if (e.command == "date") {
+    metadata.set_date(optional_value(e.value));
+  } else if (e.command == "photographer") {
+    metadata.set_photographer(optional_value(e.value));
+  } else if (e.command == "world") {
+    metadata.set_world(optional_value(e.value));
+  } else if (e.command == "add_user") {
+    metadata.add_user(e.value);
+  } else if (e.command == "delete_user") {
+    metadata.delete_user(e.value);
+  } else if (e.command == "clear_users") {
+    metadata.clear_users();
+  } else {
+    return false;
+  }
+  return true;
+}
+} // namespace
+
+int retag(const filesystem::path& input_dir, const filesystem::path& edit_list,
+          std::vector<filesystem::path>& retagged) {
+  // ファイルごとに編集をまとめる
+  std::map<filesystem::path, std::vector<edit>> edits;
+  std::ifstream ifs(edit_list);
+  if (!ifs) {
+    std::cout << "edit list not found: " << edit_list << std::endl;
+    return 1;
+  }
+  std::string line;
+  for (int line_num = 1; std::getline(ifs, line); line_num++) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    const auto file_pos    = line.find('\t');
+    const auto command_pos = line.find('\t', file_pos + 1);
+    if (file_pos == std::string::npos) {
+      std::cout << "invalid edit line " << line_num << ": " << line << std::endl;
+      continue;
+    }
+    filesystem::path path(line.substr(0, file_pos));
+    if (path.is_relative()) {
+      path = input_dir / path;
+    }
+    edit e;
+    e.command = line.substr(file_pos + 1, command_pos - file_pos - 1);
+    if (command_pos != std::string::npos) {
+      e.value = line.substr(command_pos + 1);
+    }
+    edits[path].push_back(e);
+  }
+
+  std::vector<const std::pair<const filesystem::path, std::vector<edit>>*> files;
+  for (auto& file : edits) {
+    files.push_back(&file);
+  }
+
+  int failed = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+ : failed)
+  for (int i = 0; i < files.size(); i++) {
+    auto& [path, file_edits] = *files[i];
+    try {
+      meta_tool metadata;
+      metadata.read(path);
+      for (auto& e : file_edits) {
+        if (!apply(metadata, e)) {
+          throw std::invalid_argument("unknown edit command: " + e.command);
+        }
+      }
+      metadata.write(path);
+#pragma omp critical
+      retagged.push_back(path);
+    } catch (std::exception& e) {
+#pragma omp critical
+      std::cout << "retag exception: " << path.string() << " " << e.what() << std::endl;
+      failed++;
+    }
+  }
+  std::cout << "retag " << files.size() - failed << "/" << files.size() << " files"
+            << std::endl;
+  return failed;
+}
+} // namespace vrc_photo_album2::meta_tool
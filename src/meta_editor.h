@@ -0,0 +1,17 @@
+#ifndef VRC_PHOTO_ALBUM2_META_EDITOR_H
+#define VRC_PHOTO_ALBUM2_META_EDITOR_H
+
+#include <filesystem>
+#include <vector>
+
+namespace vrc_photo_album2::meta_tool {
+namespace filesystem = std::filesystem;
+
+// 編集リストに従ってpngのvrC*チャンクだけをまとめて書き換える
+// 1行1編集でタブ区切り: <ファイル> <date|photographer|world|add_user|delete_user|clear_users> <値>
+// 値が空のdate, photographer, worldは削除 ファイルの相対パスはinput_dirから
+// 戻り値は失敗したファイル数 書き換えたファイルはretaggedに入れる
+int retag(const filesystem::path& input_dir, const filesystem::path& edit_list,
+          std::vector<filesystem::path>& retagged);
+} // namespace vrc_photo_album2::meta_tool
+#endif
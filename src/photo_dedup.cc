@@ -0,0 +1,191 @@
+#include "photo_dedup.h"
+
+#include <bit>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string_view>
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace vrc_photo_album2 {
+namespace {
+// YYYY-mm-dd_HH-MM-SS.SSS dは数字
+constexpr std::string_view time_pattern = "dddd-dd-dd_dd-dd-dd.ddd";
+
+bool match_time(std::string_view str) {
+  for (std::size_t i = 0; i < time_pattern.size(); i++) {
+    const bool digit = str[i] >= '0' && str[i] <= '9';
+    if (time_pattern[i] == 'd' ? !digit : str[i] != time_pattern[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+} // namespace
+
+photo_dedup::photo_dedup(const filesystem::path cache, const double window, const int threshold)
+    : cache_(cache), window_(window), threshold_(threshold) {
+  // filename\thash[\tkept filename]
+  std::ifstream ifs(cache_);
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::stringstream ss(line);
+    std::string name, hash, kept;
+    if (!std::getline(ss, name, '\t') || !std::getline(ss, hash, '\t')) {
+      continue;
+    }
+    const uint64_t value = std::stoull(hash, nullptr, 16);
+    if (value != 0) {
+      hashes_[name] = value;
+    }
+    if (std::getline(ss, kept, '\t') && !kept.empty()) {
+      mapping_[name] = kept;
+    }
+  }
+}
+
+void photo_dedup::collapse(std::vector<filesystem::path>& paths) {
+  const int size = paths.size();
+  std::vector<std::optional<double>> times(size);
+  for (int i = 0; i < size; i++) {
+    times[i] = shot_time(paths[i]);
+  }
+  auto near = [&](int a, int b) {
+    return times[a] && times[b] && std::abs(*times[b] - *times[a]) <= window_;
+  };
+
+  // 前後に近い時刻の写真があるものだけ先にまとめてハッシュを計算する
+  std::vector<int> targets;
+  for (int i = 0; i < size; i++) {
+    if (((i > 0 && near(i - 1, i)) || (i + 1 < size && near(i, i + 1))) &&
+        !hashes_.contains(paths[i].filename().string())) {
+      targets.push_back(i);
+    }
+  }
+  std::vector<uint64_t> computed(targets.size());
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < targets.size(); i++) {
+    computed[i] = load_hash(paths[targets[i]]);
+  }
+  for (int i = 0; i < targets.size(); i++) {
+    // 読めなかったものは次回また計算し直す
+    if (computed[i] != 0) {
+      hashes_[paths[targets[i]].filename().string()] = computed[i];
+    }
+  }
+
+  std::vector<filesystem::path> kept;
+  kept.reserve(size);
+  int last = -1;
+  for (int i = 0; i < size; i++) {
+    const std::string name = paths[i].filename().string();
+    bool duplicate         = false;
+    if (last >= 0 && near(last, i)) {
+      const std::string last_name = paths[last].filename().string();
+      auto mapped                 = mapping_.find(name);
+      if (mapped != mapping_.end() && mapped->second == last_name) {
+        // 前回の判定を優先する
+        duplicate = true;
+      } else {
+        // ファイル名順は時刻順とは限らず隣同士でない組み合わせもあるので足りなければここで計算する
+        const uint64_t a = hash(paths[last]);
+        const uint64_t b = hash(paths[i]);
+        duplicate        = a != 0 && b != 0 && std::popcount(a ^ b) <= threshold_;
+      }
+    }
+    if (duplicate) {
+      mapping_[name] = paths[last].filename().string();
+    } else {
+      mapping_.erase(name);
+      kept.push_back(paths[i]);
+      last = i;
+    }
+  }
+  std::cout << "dedup: dropped " << paths.size() - kept.size() << " of " << paths.size()
+            << " photos" << std::endl;
+  paths.swap(kept);
+}
+
+void photo_dedup::save() const {
+  std::ofstream ofs(cache_, std::ios::trunc);
+  for (auto& [name, hash] : hashes_) {
+    ofs << name << "\t" << std::hex << std::setw(16) << std::setfill('0') << hash << std::dec;
+    auto mapped = mapping_.find(name);
+    if (mapped != mapping_.end()) {
+      ofs << "\t" << mapped->second;
+    }
+    ofs << "\n";
+  }
+}
+
+uint64_t photo_dedup::hash(const filesystem::path& path) {
+  const std::string name = path.filename().string();
+  auto it                = hashes_.find(name);
+  if (it != hashes_.end()) {
+    return it->second;
+  }
+  const uint64_t value = load_hash(path);
+  if (value != 0) {
+    hashes_[name] = value;
+  }
+  return value;
+}
+
+uint64_t photo_dedup::load_hash(const filesystem::path& path) {
+  // 縮小デコードしたグレースケールで十分
+  const cv::Mat image = cv::imread(path.string(), cv::IMREAD_REDUCED_GRAYSCALE_8);
+  return image.empty() ? 0 : dhash(image);
+}
+
+uint64_t photo_dedup::dhash(const cv::Mat& image) {
+  // 9x8に縮めて横に隣り合う画素の大小を64bitにする
+  // resizeとcompareはOpenCVのSIMD実装に任せる
+  cv::Mat gray, small, bits;
+  if (image.channels() == 1) {
+    gray = image;
+  } else {
+    cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+  }
+  cv::resize(gray, small, cv::Size(9, 8), 0, 0, cv::INTER_AREA);
+  cv::compare(small.colRange(1, 9), small.colRange(0, 8), bits, cv::CMP_GT);
+
+  uint64_t hash = 0;
+  for (int y = 0; y < bits.rows; y++) {
+    const uchar* row = bits.ptr<uchar>(y);
+    for (int x = 0; x < bits.cols; x++) {
+      hash = (hash << 1) | (row[x] & 1);
+    }
+  }
+  // 0は計算失敗の印に使うので避ける
+  return hash == 0 ? 1 : hash;
+}
+
+std::optional<double> photo_dedup::shot_time(const filesystem::path& path) {
+  // VRChat_CCCCxRRRR_YYYY-mm-dd_HH-MM-SS.SSS.png と
+  // VRChat_YYYY-mm-dd_HH-MM-SS.SSS_CCCCxRRRR.png のどちらも日時の部分を探して読む
+  const std::string name = path.filename().string();
+  std::string date;
+  for (std::size_t pos = 0; pos + time_pattern.size() <= name.size(); pos++) {
+    if (match_time(std::string_view(name).substr(pos, time_pattern.size()))) {
+      date = name.substr(pos, time_pattern.size());
+      break;
+    }
+  }
+  if (date.empty()) {
+    return std::nullopt;
+  }
+  std::tm tm{};
+  std::istringstream ss(date);
+  ss >> std::get_time(&tm, "%Y-%m-%d_%H-%M-%S");
+  int milli = 0;
+  if (ss.fail() || ss.get() != '.' || !(ss >> milli)) {
+    return std::nullopt;
+  }
+  return static_cast<double>(timegm(&tm)) + milli / 1000.0;
+}
+} // namespace vrc_photo_album2
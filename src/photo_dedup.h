@@ -0,0 +1,38 @@
+#ifndef VRC_PHOTO_ALBUM2_PHOTO_DEDUP_H
+#define VRC_PHOTO_ALBUM2_PHOTO_DEDUP_H
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+namespace vrc_photo_album2 {
+namespace filesystem = std::filesystem;
+
+// 連写でほぼ同じ画像になったものをまとめる
+// 撮影時刻がwindow秒以内でdHashのハミング距離がthreshold以下なら重複扱い
+// ハッシュと重複先はcacheに保存して次回以降も同じ判定になるようにする
+class photo_dedup {
+public:
+  photo_dedup(const filesystem::path cache, const double window, const int threshold);
+  void collapse(std::vector<filesystem::path>& paths);
+  void save() const;
+  static uint64_t dhash(const cv::Mat& image);
+
+private:
+  uint64_t hash(const filesystem::path& path);
+  static uint64_t load_hash(const filesystem::path& path);
+  static std::optional<double> shot_time(const filesystem::path& path);
+
+  filesystem::path cache_;
+  double window_;
+  int threshold_;
+  std::map<std::string, uint64_t> hashes_;
+  std::map<std::string, std::string> mapping_;
+};
+} // namespace vrc_photo_album2
+#endif
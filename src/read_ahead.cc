@@ -0,0 +1,232 @@
+#include "read_ahead.h"
+
+#include <algorithm>
+#include <fstream>
+
+#ifdef VRC_PHOTO_ALBUM2_USE_IO_URING
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "util.h"
+
+namespace vrc_photo_album2 {
+
+read_ahead::read_ahead(const std::size_t max_bytes, const int threads) : max_bytes_(max_bytes) {
+#ifdef VRC_PHOTO_ALBUM2_USE_IO_URING
+  // コンテナ等でio_uringが使えない環境ではスレッドプールに切り替える
+  use_io_uring_ = io_uring_queue_init(queue_depth_, &ring_, 0) == 0;
+  if (use_io_uring_) {
+    threads_.emplace_back(&read_ahead::worker, this, queue_depth_);
+    return;
+  }
+#endif
+  for (int i = 0; i < std::max(threads, 1); i++) {
+    threads_.emplace_back(&read_ahead::worker, this, 1);
+  }
+}
+
+read_ahead::~read_ahead() {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+#ifdef VRC_PHOTO_ALBUM2_USE_IO_URING
+  if (use_io_uring_) {
+    io_uring_queue_exit(&ring_);
+  }
+#endif
+}
+
+void read_ahead::request(const filesystem::path& path) {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!entries_.try_emplace(path).second) {
+      return;
+    }
+    queue_.push_back(path);
+  }
+  cv_.notify_all();
+}
+
+void read_ahead::take(const filesystem::path& path, std::vector<unsigned char>& buf) {
+  std::unique_lock<std::mutex> lock(mtx_);
+  auto it = entries_.find(path);
+  if (it == entries_.end()) {
+    // 先読みしていないファイルはその場で読む
+    lock.unlock();
+    read_file(path, buf);
+    return;
+  }
+  cv_.wait(lock, [&] { return it->second.ready; });
+  const bool failed = it->second.failed;
+  // 呼び出し側の古いバッファは次の先読みで使い回す
+  buf.swap(it->second.buf);
+  spare_.push_back(std::move(it->second.buf));
+  bytes_ -= it->second.size;
+  entries_.erase(it);
+  lock.unlock();
+  cv_.notify_all();
+
+  if (failed) {
+    read_file(path, buf);
+  }
+}
+
+bool read_ahead::use_io_uring() const {
+  return use_io_uring_;
+}
+
+void read_ahead::worker(const std::size_t batch) {
+  std::vector<job> jobs;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mtx_);
+      cv_.wait(lock, [&] { return stop_ || (!queue_.empty() && bytes_ < max_bytes_); });
+      if (stop_) {
+        return;
+      }
+      while (!queue_.empty() && jobs.size() < batch) {
+        job j;
+        j.path = std::move(queue_.front());
+        queue_.pop_front();
+        if (!spare_.empty()) {
+          j.buf = std::move(spare_.back());
+          spare_.pop_back();
+        }
+        jobs.push_back(std::move(j));
+      }
+    }
+
+    std::vector<std::size_t> sizes(jobs.size());
+    for (int i = 0; i < jobs.size(); i++) {
+      std::error_code ec;
+      sizes[i] = filesystem::file_size(jobs[i].path, ec);
+      jobs[i].failed = static_cast<bool>(ec);
+      jobs[i].buf.resize(jobs[i].failed ? 0 : sizes[i]);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      for (int i = 0; i < jobs.size(); i++) {
+        entries_[jobs[i].path].size = jobs[i].buf.size();
+        bytes_ += jobs[i].buf.size();
+      }
+    }
+
+    load(jobs);
+
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      for (auto& j : jobs) {
+        auto& e  = entries_[j.path];
+        e.buf    = std::move(j.buf);
+        e.failed = j.failed;
+        e.ready  = true;
+      }
+    }
+    cv_.notify_all();
+    jobs.clear();
+  }
+}
+
+void read_ahead::load(std::vector<job>& jobs) {
+#ifdef VRC_PHOTO_ALBUM2_USE_IO_URING
+  if (use_io_uring_) {
+    load_io_uring(jobs);
+    return;
+  }
+#endif
+  load_sync(jobs);
+}
+
+void read_ahead::load_sync(std::vector<job>& jobs) {
+  for (auto& j : jobs) {
+    if (j.failed) {
+      continue;
+    }
+    std::ifstream ifs(j.path, std::ios::binary);
+    ifs.read(reinterpret_cast<char*>(j.buf.data()), j.buf.size());
+    j.failed = !ifs;
+  }
+}
+
+#ifdef VRC_PHOTO_ALBUM2_USE_IO_URING
+void read_ahead::load_io_uring(std::vector<job>& jobs) {
+  std::vector<int> fds(jobs.size(), -1);
+  std::vector<std::size_t> done(jobs.size(), 0);
+  int pending = 0;
+  bool broken = false;
+
+  auto submit = [&](const std::size_t k) {
+    io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+    io_uring_prep_read(sqe, fds[k], jobs[k].buf.data() + done[k], jobs[k].buf.size() - done[k],
+                       done[k]);
+    io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(k));
+    pending++;
+  };
+
+  for (std::size_t k = 0; k < jobs.size(); k++) {
+    if (jobs[k].failed || jobs[k].buf.empty()) {
+      continue;
+    }
+    fds[k] = open(jobs[k].path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fds[k] < 0) {
+      jobs[k].failed = true;
+      continue;
+    }
+    submit(k);
+  }
+  io_uring_submit(&ring_);
+
+  while (pending > 0) {
+    io_uring_cqe* cqe;
+    const int ret = io_uring_wait_cqe(&ring_, &cqe);
+    if (ret == -EINTR) {
+      continue;
+    }
+    if (ret < 0) {
+      if (!broken) {
+        // 残りは同期読み込みに任せるが、投げた読み込みが終わるまではバッファを手放せない
+        broken = true;
+        for (auto& j : jobs) {
+          j.failed = true;
+        }
+        continue;
+      }
+      // 回収もできないならリングごと閉じてカーネル側に取り消させ、以降はスレッドで読む
+      io_uring_queue_exit(&ring_);
+      use_io_uring_ = false;
+      break;
+    }
+    const auto k  = reinterpret_cast<std::size_t>(io_uring_cqe_get_data(cqe));
+    const int res = cqe->res;
+    io_uring_cqe_seen(&ring_, cqe);
+    pending--;
+
+    if (broken) {
+      continue;
+    }
+    if (res <= 0) {
+      jobs[k].failed = true;
+    } else {
+      done[k] += res;
+      // 短い読み込みは続きから投げ直す
+      if (done[k] < jobs[k].buf.size()) {
+        submit(k);
+        io_uring_submit(&ring_);
+      }
+    }
+  }
+
+  for (int fd : fds) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+#endif
+} // namespace vrc_photo_album2
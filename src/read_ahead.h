@@ -0,0 +1,64 @@
+#ifndef VRC_PHOTO_ALBUM2_READ_AHEAD_H
+#define VRC_PHOTO_ALBUM2_READ_AHEAD_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef VRC_PHOTO_ALBUM2_USE_IO_URING
+#include <liburing.h>
+#endif
+
+namespace vrc_photo_album2 {
+namespace filesystem = std::filesystem;
+
+// 先のセグメントの画像ファイルをバックグラウンドでメモリに読み込んでおく
+// io_uringが使えればまとめて投げて、使えなければスレッドプールで読む
+class read_ahead {
+public:
+  read_ahead(const std::size_t max_bytes, const int threads = 4);
+  ~read_ahead();
+  void request(const filesystem::path& path);
+  void take(const filesystem::path& path, std::vector<unsigned char>& buf);
+  bool use_io_uring() const;
+
+private:
+  struct entry {
+    std::vector<unsigned char> buf;
+    std::size_t size = 0;
+    bool ready       = false;
+    bool failed      = false;
+  };
+  struct job {
+    filesystem::path path;
+    std::vector<unsigned char> buf;
+    bool failed = false;
+  };
+
+  void worker(const std::size_t batch);
+  void load(std::vector<job>& jobs);
+  void load_sync(std::vector<job>& jobs);
+
+  const std::size_t max_bytes_;
+  std::size_t bytes_ = 0;
+  bool stop_         = false;
+  std::deque<filesystem::path> queue_;
+  std::map<filesystem::path, entry> entries_;
+  std::vector<std::vector<unsigned char>> spare_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::vector<std::thread> threads_;
+  std::atomic<bool> use_io_uring_ = false;
+#ifdef VRC_PHOTO_ALBUM2_USE_IO_URING
+  void load_io_uring(std::vector<job>& jobs);
+  static constexpr unsigned int queue_depth_ = 32;
+  io_uring ring_;
+#endif
+};
+} // namespace vrc_photo_album2
+#endif
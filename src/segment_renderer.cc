@@ -0,0 +1,210 @@
+#include "segment_renderer.h"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include <boost/format.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "image_generator.h"
+#include "util.h"
+
+namespace vrc_photo_album2 {
+
+segment_renderer::segment_renderer(
+    const std::vector<filesystem::path>& paths, const int tile_size, const cv::Size output_size,
+    const filesystem::path font, const filesystem::path output_dir,
+    const filesystem::path video_dir, const std::string file_pref,
+    const std::vector<std::tuple<std::string, std::string>>& generate_sizes,
+    const std::size_t prefetch_bytes, const bool raw_yuv)
+    : paths_(paths),
+      tile_size_(tile_size),
+      output_size_(output_size),
+      font_(font),
+      output_dir_(output_dir),
+      video_dir_(video_dir),
+      file_pref_(file_pref),
+      generate_sizes_(generate_sizes),
+      raw_yuv_(raw_yuv),
+      output_pool_(output_size, CV_8UC3),
+      sources_(tile_size),
+      dsts_(tile_size + 1),
+      files_(tile_size),
+      encoded_(tile_size + 1),
+      yuv_(tile_size + 1),
+      reader_(prefetch_bytes) {
+  segment_num_ = (paths_.size() + tile_size_ - 1) / tile_size_;
+  images_.reserve(tile_size_);
+
+  const filesystem::path blank_path = "./blank.png";
+  const cv::Mat blank_image         = cv::imread(blank_path);
+  // 空きフレームは毎回同じなのでエンコード結果を使い回す
+  cv::imencode(".png", blank_image, blank_png_);
+  if (raw_yuv_) {
+    cv::Mat blank = blank_image;
+    if (blank.size() != output_size_) {
+      cv::resize(blank_image, blank, output_size_);
+    }
+    cv::cvtColor(blank, blank_yuv_, cv::COLOR_BGR2YUV_I420);
+    // ffmpegが途中で落ちてもパイプへの書き込みで終了させられないようにする
+    std::signal(SIGPIPE, SIG_IGN);
+  }
+
+  std::cout << "read ahead: " << (reader_.use_io_uring() ? "io_uring" : "threads") << std::endl;
+}
+
+int segment_renderer::segment_num() const {
+  return segment_num_;
+}
+
+void segment_renderer::request(const int i) {
+  if (i < 0 || i >= segment_num_) {
+    return;
+  }
+  auto it   = std::next(paths_.begin(), i * tile_size_);
+  int bound = bound_load(it, paths_.end(), tile_size_);
+  for (int j = 0; j < bound; j++) {
+    reader_.request(*(std::next(it, j)));
+  }
+}
+
+std::string segment_renderer::segment_path(const std::string& quality, const int i) const {
+  return (boost::format("%s_%s_%s_%06d") % video_dir_.string() % file_pref_ % quality % i)
+      .str();
+}
+
+bool segment_renderer::render(const int i) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  const int index = i * tile_size_;
+  auto it         = std::next(paths_.begin(), index);
+  int bound       = bound_load(it, paths_.end(), tile_size_);
+  images_.resize(bound);
+  // 先読みしていなければここでまとめて読み込みを投げる
+  request(i);
+  // 並列区間の外へ例外を投げられないので失敗は数えて後で返す
+  int failed = 0;
+#pragma omp parallel for reduction(+ : failed)
+  for (int j = 0; j < bound; j++) {
+    try {
+      reader_.take(*(std::next(it, j)), files_[j]);
+      cv::imdecode(files_[j], cv::IMREAD_COLOR, &sources_[j]);
+      images_[j] = sources_[j];
+    } catch (std::exception& e) {
+#pragma omp critical
+      std::cout << "read exception: " << std::next(it, j)->string() << " " << e.what()
+                << std::endl;
+      failed++;
+    }
+  }
+  if (failed > 0) {
+    images_.clear();
+    return false;
+  }
+  image_generator generator(output_size_, font_);
+  dsts_[0] = output_pool_.acquire();
+  generator.generate_tile(it, images_, dsts_[0]);
+
+#pragma omp parallel for reduction(+ : failed)
+  for (int j = 0; j < bound; j++) {
+    auto id = std::next(it, j);
+    image_generator generator(output_size_, font_);
+    // tile_size - jで新しいファイルからjで昔のファイルから (1)
+    cv::Mat& dst = dsts_[(tile_size_ - 1) - j + 1];
+    dst          = output_pool_.acquire();
+    try {
+      generator.generate_single(*id, images_[j], dst);
+    } catch (std::exception& e) {
+#pragma omp critical
+      std::cout << "generate exception: " << id->string() << " " << e.what() << std::endl;
+      failed++;
+    }
+  }
+  // ヘッダだけ外してバッファはsources_に残す
+  images_.clear();
+  if (failed > 0) {
+    output_pool_.release(dsts_);
+    return false;
+  }
+
+  // pngのエンコードとffmpeg側のデコードを省けるのでyuv420pの生データで渡す
+  // resizeもFreeTypeもBGRにしか描けず、I420は画面全体でしか作れないので合成後にまとめて変換する
+  if (raw_yuv_) {
+#pragma omp parallel for
+    for (int j = 0; j < dsts_.size(); j++) {
+      if (!dsts_[j].empty()) {
+        cv::cvtColor(dsts_[j], yuv_[j], cv::COLOR_BGR2YUV_I420);
+      }
+    }
+  } else {
+#pragma omp parallel for
+    for (int j = 0; j < dsts_.size(); j++) {
+      const std::string png =
+          (boost::format("%s_%s%06d_%05d.png") % output_dir_.string() % file_pref_ % i % (j))
+              .str();
+      // tile_size - jで新しいファイルからjで昔のファイルから (2)
+      // 埋まらなかった枠は空きフレーム
+      if (dsts_[j].empty()) {
+        write_file(png, blank_png_);
+      } else {
+        cv::imencode(".png", dsts_[j], encoded_[j]);
+        write_file(png, encoded_[j]);
+      }
+    }
+  }
+
+  // 10枚毎のブロック生成部分
+  bool succeeded = true;
+  for (auto& [quality, size] : generate_sizes_) {
+    const std::string input =
+        raw_yuv_ ? (boost::format("-f rawvideo -pix_fmt yuv420p -s %dx%d -framerate 1 -i -") %
+                    output_size_.width % output_size_.height)
+                       .str()
+                 : (boost::format("-framerate 1 -i %s_%s%06d_%s.png") % output_dir_.string() %
+                    file_pref_ % i % "%05d")
+                       .str();
+    // 書きかけのtsを読まれないように別名で書いてから置き換える
+    const std::string ts = segment_path(quality, i) + "_0.ts";
+    std::string command  = (boost::format("ffmpeg -loglevel error %s -vcodec libx264 "
+                                          "-pix_fmt yuv420p -r 5 -f hls -hls_time 10 "
+                                          "-hls_playlist_type vod -hls_segment_filename "
+                                          "\"%s_%s.ts.part\" -s %s %s.m3u8") %
+                            input % segment_path(quality, i) % "%1d" % size %
+                            segment_path(quality, i))
+                               .str();
+    std::cout << command << std::endl;
+    int status = -1;
+    if (!raw_yuv_) {
+      status = std::system(command.c_str());
+    } else if (FILE* pipe = popen(command.c_str(), "w")) {
+      // 一時ファイルを経由せずffmpegの標準入力へ直接流す
+      for (int j = 0; j < dsts_.size(); j++) {
+        // 埋まらなかった枠は空きフレーム
+        const cv::Mat& frame   = dsts_[j].empty() ? blank_yuv_ : yuv_[j];
+        const std::size_t size = frame.total() * frame.elemSize();
+        if (std::fwrite(frame.data, 1, size, pipe) != size) {
+          break;
+        }
+      }
+      status = pclose(pipe);
+    }
+    if (status != 0 || !filesystem::exists(ts + ".part")) {
+      std::cout << "ffmpeg failed: segment " << i << " " << quality << std::endl;
+      std::error_code ec;
+      filesystem::remove(ts + ".part", ec);
+      succeeded = false;
+      continue;
+    }
+    std::error_code ec;
+    filesystem::rename(ts + ".part", ts, ec);
+    if (ec) {
+      std::cout << "rename failed: " << ts << " " << ec.message() << std::endl;
+      succeeded = false;
+    }
+  }
+  output_pool_.release(dsts_);
+  return succeeded;
+}
+} // namespace vrc_photo_album2
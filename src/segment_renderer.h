@@ -0,0 +1,62 @@
+#ifndef VRC_PHOTO_ALBUM2_SEGMENT_RENDERER_H
+#define VRC_PHOTO_ALBUM2_SEGMENT_RENDERER_H
+
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "frame_pool.h"
+#include "read_ahead.h"
+
+namespace vrc_photo_album2 {
+namespace filesystem = std::filesystem;
+
+// tile_size枚ごとのセグメントをpngに書き出してqualityごとにtsへエンコードする
+// raw_yuvならpngの代わりにyuv420pの生データをffmpegの標準入力へ流す
+// バッファを共有しているのでrenderは同時に1つだけ動く
+class segment_renderer {
+public:
+  segment_renderer(const std::vector<filesystem::path>& paths, const int tile_size,
+                   const cv::Size output_size, const filesystem::path font,
+                   const filesystem::path output_dir, const filesystem::path video_dir,
+                   const std::string file_pref,
+                   const std::vector<std::tuple<std::string, std::string>>& generate_sizes,
+                   const std::size_t prefetch_bytes, const bool raw_yuv = false);
+  int segment_num() const;
+  void request(const int i);
+  // 写真の読み込みやffmpegがどれか1つでも失敗したらfalse
+  bool render(const int i);
+  // video_dir/_prefix_quality_iiiiii (拡張子なし)
+  std::string segment_path(const std::string& quality, const int i) const;
+
+private:
+  const std::vector<filesystem::path>& paths_;
+  const int tile_size_;
+  const cv::Size output_size_;
+  const filesystem::path font_;
+  const filesystem::path output_dir_;
+  const filesystem::path video_dir_;
+  const std::string file_pref_;
+  const std::vector<std::tuple<std::string, std::string>> generate_sizes_;
+  const bool raw_yuv_;
+  int segment_num_;
+
+  std::mutex mtx_;
+  std::vector<uchar> blank_png_;
+  cv::Mat blank_yuv_;
+  frame_pool output_pool_;
+  // 写真はサイズがまちまちなので枠ごとにデコード先を持ち、同じサイズなら使い回す
+  std::vector<cv::Mat> sources_;
+  std::vector<cv::Mat> images_;
+  std::vector<cv::Mat> dsts_;
+  std::vector<std::vector<uchar>> files_;
+  std::vector<std::vector<uchar>> encoded_;
+  std::vector<cv::Mat> yuv_;
+  read_ahead reader_;
+};
+} // namespace vrc_photo_album2
+#endif
@@ -3,7 +3,9 @@
 
 #include <chrono>
 #include <filesystem>
+#include <fstream>
 #include <string>
+#include <vector>
 
 namespace vrc_photo_album2 {
 namespace filesystem = std::filesystem;
@@ -25,5 +27,17 @@ inline std::tm conv_fclock(filesystem::file_time_type ftime) {
   const std::tm* lt = std::localtime(&count);
   return *lt;
 }
+
+// bufは容量を保ったまま使い回す
+inline void read_file(const filesystem::path& path, std::vector<unsigned char>& buf) {
+  std::ifstream ifs(path, std::ios::binary);
+  buf.resize(filesystem::file_size(path));
+  ifs.read(reinterpret_cast<char*>(buf.data()), buf.size());
+}
+
+inline void write_file(const filesystem::path& path, const std::vector<unsigned char>& buf) {
+  std::ofstream ofs(path, std::ios::binary);
+  ofs.write(reinterpret_cast<const char*>(buf.data()), buf.size());
+}
 } // namespace vrc_photo_album2
 #endif
@@ -1,5 +1,6 @@
 #include "vrc_meta_tool.h"
 
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 #include <iostream>
@@ -7,82 +8,225 @@
 
 #include <boost/format.hpp>
 
+#include "crc32.h"
+
 namespace vrc_photo_album2::meta_tool {
+namespace {
+bool user_less(const user_entry& e, std::string_view name) {
+  return e.name < name;
+}
+
+constexpr int png_header_size                = 8;
+const unsigned char png_sig[png_header_size] = {0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a};
+const char* const vrc_meta_chunks[]          = {"vrCd", "vrCp", "vrCw", "vrCu"};
+
+void copy_range(std::ifstream& ifs, std::ofstream& ofs, std::streamoff offset,
+                std::streamoff size, std::vector<char>& buf) {
+  ifs.seekg(offset);
+  while (size > 0) {
+    const std::streamsize n = std::min<std::streamoff>(size, buf.size());
+    ifs.read(buf.data(), n);
+    ofs.write(buf.data(), n);
+    size -= n;
+  }
+}
+} // namespace
+
+meta_record::meta_record(std::pmr::memory_resource* upstream)
+    : arena_(initial_.data(), initial_.size(), upstream), users(&arena_) {}
+
+char* meta_record::allocate(std::size_t size) {
+  return static_cast<char*>(arena_.allocate(std::max<std::size_t>(size, 1), 1));
+}
+
+std::string_view meta_record::store(std::string_view str) {
+  char* data = allocate(str.size());
+  std::memcpy(data, str.data(), str.size());
+  return std::string_view(data, str.size());
+}
+
+void meta_record::add_user(std::string_view user) {
+  // twitterのidがあれば分割
+  const std::string_view delemiter = " : ";
+  user_entry entry{user, std::nullopt};
+  auto pos = user.rfind(delemiter);
+  if (pos != std::string_view::npos) {
+    entry.name        = user.substr(0, pos);
+    entry.screen_name = user.substr(pos + delemiter.length());
+  }
+  // 名前順を保って挿入 同名は先勝ち
+  auto it = std::lower_bound(users.begin(), users.end(), entry.name, user_less);
+  if (it == users.end() || it->name != entry.name) {
+    users.insert(it, entry);
+  }
+}
+
+void meta_record::delete_user(std::string_view user_name) {
+  auto it = std::lower_bound(users.begin(), users.end(), user_name, user_less);
+  if (it != users.end() && it->name == user_name) {
+    users.erase(it);
+  }
+}
+
+void meta_record::clear_users() {
+  std::pmr::vector<user_entry>(&arena_).swap(users);
+}
+
+void meta_record::clear() {
+  date         = std::nullopt;
+  photographer = std::nullopt;
+  world        = std::nullopt;
+  clear_users();
+  arena_.release();
+}
 
 chunk_util::chunk_util(filesystem::path path) : path_(path) {}
 
 decltype(auto) chunk_util::parse_chunk(chunk_s& chunk) {
-  // chunk.dataは終端文字が入っていないため部分文字列を取得する
-  return std::make_tuple(std::string(reinterpret_cast<char*>(chunk.head_.type), 4),
-                         std::string(reinterpret_cast<char*>(chunk.data_), chunk.size()));
+  // chunk.dataは終端文字が入っていないため長さ付きのviewにする
+  return std::make_tuple(std::string_view(chunk.head_.type, 4),
+                         std::string_view(chunk.data_, chunk.size()));
 }
 
-decltype(auto) chunk_util::read() {
-  constexpr int png_header_size                = 8;
-  const unsigned char png_sig[png_header_size] = {0x89, 0x50, 0x4e, 0x47,
-                                                  0x0d, 0x0a, 0x1a, 0x0a};
-  auto meta_chunks = std::make_unique<std::vector<std::tuple<std::string, std::string>>>();
+bool chunk_util::is_meta_chunk(const char* type) {
+  for (auto meta_chunk : vrc_meta_chunks) {
+    if (std::strncmp(type, meta_chunk, 4) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  char header[png_header_size];
+void chunk_util::read(meta_record& record) {
+  char sig[png_header_size];
   std::ifstream ifs(path_.string(), std::ios::binary);
-  ifs.read(header, 8);
+  ifs.read(sig, png_header_size);
 
-  if (std::strncmp((char*)header, (char*)png_sig, png_header_size) != 0) {
+  if (!ifs || std::memcmp(sig, png_sig, png_header_size) != 0) {
     throw std::invalid_argument("not png file.");
   }
 
-  std::stringstream ss{
-      std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>())};
-
-  std::vector<const char*> vrc_meta_chunks;
-  vrc_meta_chunks.push_back("vrCd");
-  vrc_meta_chunks.push_back("vrCp");
-  vrc_meta_chunks.push_back("vrCw");
-  vrc_meta_chunks.push_back("vrCu");
-
+  // IDATなどは読み飛ばしてvrC*チャンクの中身だけarenaへ直接読み込む
   for (;;) {
     chunk_s ch;
-    ss.read((char*)&ch.head_, sizeof(header));
+    ifs.read((char*)&ch.head_, sizeof(header));
+    if (!ifs) {
+      throw std::invalid_argument("broken png file.");
+    }
 
     if (std::strncmp(ch.head_.type, "IEND", 4) == 0) {
-      return meta_chunks;
+      return;
     }
 
-    bool skip = true;
-    for (auto meta_chunk : vrc_meta_chunks) {
-      if (std::strncmp(ch.head_.type, meta_chunk, 4) == 0) {
-        skip = false;
-        std::vector<char> dat(ch.size());
-        ch.data_ = dat.data();
-        ss.read((char*)ch.data_, ch.size());
-        ss.seekg(4, std::iostream::cur);
-        auto chunk = parse_chunk(ch);
-        meta_chunks->push_back(chunk);
+    if (is_meta_chunk(ch.head_.type)) {
+      ch.data_ = record.allocate(ch.size());
+      ifs.read(ch.data_, ch.size());
+      ifs.seekg(4, std::iostream::cur);
+      auto [type, data] = parse_chunk(ch);
+      if (type == "vrCd") {
+        record.date = data;
+      } else if (type == "vrCp") {
+        record.photographer = data;
+      } else if (type == "vrCw") {
+        record.world = data;
+      } else if (type == "vrCu") {
+        record.add_user(data);
       }
+    } else {
+      ifs.seekg(ch.size() + 4, std::iostream::cur);
+    }
+  }
+}
+
+void chunk_util::write(const std::vector<std::tuple<std::string, std::string>>& chunks) {
+  std::string meta;
+  for (auto& [type, data] : chunks) {
+    meta += create_chunk(type, data);
+  }
+  meta += create_chunk("IEND", "");
+
+  char sig[png_header_size];
+  std::ifstream ifs(path_.string(), std::ios::binary);
+  ifs.read(sig, png_header_size);
+  if (!ifs || std::memcmp(sig, png_sig, png_header_size) != 0) {
+    throw std::invalid_argument("not png file.");
+  }
+
+  // チャンクの位置だけ拾ってIDATの中身は読まない
+  struct chunk_pos {
+    std::streamoff offset;
+    std::streamoff size;
+    bool meta;
+  };
+  std::vector<chunk_pos> positions;
+  std::streamoff pos = png_header_size;
+  for (;;) {
+    header head;
+    ifs.seekg(pos);
+    ifs.read((char*)&head, sizeof(header));
+    if (!ifs) {
+      throw std::invalid_argument("broken png file.");
+    }
+    if (std::strncmp(head.type, "IEND", 4) == 0) {
+      break;
     }
+    const std::streamoff size = sizeof(header) + ntohl(head.size) + 4;
+    positions.push_back({pos, size, is_meta_chunk(head.type)});
+    pos += size;
+  }
 
-    if (skip) {
-      ss.seekg(ch.size() + 4, std::iostream::cur);
+  // 元のファイルは書き終わるまで触らず、他のチャンクをコピーした一時ファイルと置き換える
+  filesystem::path tmp = path_;
+  tmp += ".tmp";
+  {
+    std::ofstream ofs(tmp.string(), std::ios::binary | std::ios::trunc);
+    std::vector<char> buf(1 << 20);
+    ofs.write((const char*)png_sig, png_header_size);
+    for (auto& p : positions) {
+      if (!p.meta) {
+        copy_range(ifs, ofs, p.offset, p.size, buf);
+      }
+    }
+    ofs.write(meta.data(), meta.size());
+    ofs.close();
+    if (!ifs || !ofs) {
+      std::error_code ec;
+      filesystem::remove(tmp, ec);
+      throw std::runtime_error("write png failed.");
     }
   }
+  ifs.close();
+  filesystem::rename(tmp, path_);
 }
 
-// decltype(auto) chunk_util::write() {}
+std::string chunk_util::create_chunk(std::string_view type, std::string_view data) {
+  // length(4) type(4) data crc(4) crcはtypeとdataから計算する
+  std::string chunk(sizeof(header) + data.size() + 4, '\0');
+  const uint32_t size = htonl(data.size());
+  std::memcpy(chunk.data(), &size, 4);
+  std::memcpy(chunk.data() + 4, type.data(), 4);
+  std::memcpy(chunk.data() + 8, data.data(), data.size());
+  const auto* crc_data = reinterpret_cast<const unsigned char*>(chunk.data() + 4);
+  const uint32_t crc    = htonl(crc32(0, crc_data, data.size() + 4));
+  std::memcpy(chunk.data() + 8 + data.size(), &crc, 4);
+  return chunk;
+}
 
-// decltype(auto) chunk_util::create_chunk() {}
+meta_tool::meta_tool(std::pmr::memory_resource* upstream) : data_(upstream) {}
 
 std::string meta_tool::date() const {
-  return data_.date.value_or("");
+  return std::string(data_.date.value_or(""));
 }
 
 std::string meta_tool::readable_date() const {
-  const std::string year   = data_.date.value().substr(0, 4);
-  const std::string month  = data_.date.value().substr(4, 2);
-  const std::string day    = data_.date.value().substr(6, 2);
-  const std::string hour   = data_.date.value().substr(8, 2);
-  const std::string minute = data_.date.value().substr(10, 2);
-  const std::string second = data_.date.value().substr(12, 2);
-  // const std::string milli  = data_.date.value().substr(14, 3);
+  const std::string_view date   = data_.date.value();
+  const std::string_view year   = date.substr(0, 4);
+  const std::string_view month  = date.substr(4, 2);
+  const std::string_view day    = date.substr(6, 2);
+  const std::string_view hour   = date.substr(8, 2);
+  const std::string_view minute = date.substr(10, 2);
+  const std::string_view second = date.substr(12, 2);
+  // const std::string_view milli  = date.substr(14, 3);
 
   return (boost::format("%04d-%02d-%02d %02d:%02d:%02d") % year % month % day % hour % minute %
           second)
@@ -90,15 +234,20 @@ std::string meta_tool::readable_date() const {
 }
 
 std::string meta_tool::photographer() const {
-  return data_.photographer.value_or("");
+  return std::string(data_.photographer.value_or(""));
 }
 
 std::string meta_tool::world() const {
-  return data_.world.value_or("");
+  return std::string(data_.world.value_or(""));
 }
 
 std::map<std::string, std::optional<std::string>> meta_tool::users() const {
-  return data_.users;
+  std::map<std::string, std::optional<std::string>> users;
+  for (auto& [user_name, screen_name] : data_.users) {
+    users.emplace_hint(users.end(), user_name,
+                       screen_name ? std::optional<std::string>(*screen_name) : std::nullopt);
+  }
+  return users;
 }
 
 bool meta_tool::has_any() const {
@@ -125,63 +274,75 @@ bool meta_tool::has_users() const {
   return !data_.users.empty();
 }
 
-void meta_tool::set_date(std::optional<std::string> date) {
-  data_.date = date;
+std::size_t meta_tool::user_count() const {
+  return data_.users.size();
 }
 
-void meta_tool::set_photographer(std::optional<std::string> photographer) {
-  data_.photographer = photographer;
+std::pmr::vector<user_entry>::const_iterator meta_tool::users_begin() const {
+  return data_.users.begin();
 }
 
-void meta_tool::set_world(std::optional<std::string> world) {
-  data_.world = world;
+std::pmr::vector<user_entry>::const_iterator meta_tool::users_end() const {
+  return data_.users.end();
 }
 
-void meta_tool::add_user(std::string user) {
-  // twitterのidがあれば分割
-  const std::string_view delemiter = " : ";
-  auto pos                         = user.rfind(delemiter);
-  if (pos != std::string::npos) {
-    data_.users.insert(
-        std::make_pair(user.substr(0, pos), user.substr(pos + delemiter.length())));
-  } else {
-    data_.users.insert(std::make_pair(user, std::nullopt));
-  }
+void meta_tool::set_date(std::optional<std::string_view> date) {
+  data_.date = date ? std::optional(data_.store(*date)) : std::nullopt;
+}
+
+void meta_tool::set_photographer(std::optional<std::string_view> photographer) {
+  data_.photographer = photographer ? std::optional(data_.store(*photographer)) : std::nullopt;
+}
+
+void meta_tool::set_world(std::optional<std::string_view> world) {
+  data_.world = world ? std::optional(data_.store(*world)) : std::nullopt;
+}
+
+void meta_tool::add_user(std::string_view user) {
+  data_.add_user(data_.store(user));
 }
 
-void meta_tool::delete_user(std::string user_name) {
-  data_.users.erase(user_name);
+void meta_tool::delete_user(std::string_view user_name) {
+  data_.delete_user(user_name);
 }
 
 void meta_tool::clear_users() {
-  std::map<std::string, std::optional<std::string>>().swap(data_.users);
+  data_.clear_users();
 }
 
 void meta_tool::read(filesystem::path path) {
-  // dateの初期化
-  set_date(std::nullopt);
-  set_photographer(std::nullopt);
-  set_world(std::nullopt);
-  clear_users();
+  // 前回の内容とarenaの初期化
+  data_.clear();
 
   chunk_util util(path);
   try {
-    auto chunks = util.read();
-    // auto chunks = util.read();
-    for (auto chunk : *chunks) {
-      auto [type, data] = chunk;
-      if (type == "vrCd") {
-        set_date(data);
-      } else if (type == "vrCp") {
-        set_photographer(data);
-      } else if (type == "vrCw") {
-        set_world(data);
-      } else if (type == "vrCu") {
-        add_user(data);
-      }
-    }
+    util.read(data_);
   } catch (...) {
     std::cout << "read png exception: " << path.string() << std::endl;
   }
 }
+
+void meta_tool::write(filesystem::path path) const {
+  std::vector<std::tuple<std::string, std::string>> chunks;
+  if (has_date()) {
+    chunks.emplace_back("vrCd", data_.date.value());
+  }
+  if (has_photographer()) {
+    chunks.emplace_back("vrCp", data_.photographer.value());
+  }
+  if (has_world()) {
+    chunks.emplace_back("vrCw", data_.world.value());
+  }
+  for (auto& [user_name, screen_name] : data_.users) {
+    // add_userで分割したtwitterのidを戻す
+    std::string user(user_name);
+    if (screen_name) {
+      user.append(" : ").append(*screen_name);
+    }
+    chunks.emplace_back("vrCu", user);
+  }
+
+  chunk_util util(path);
+  util.write(chunks);
+}
 } // namespace vrc_photo_album2::meta_tool
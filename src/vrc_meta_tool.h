@@ -2,23 +2,52 @@
 #define VRC_PHOTO_ALBUM2_VRC_META_TOOL_H
 
 #include <netinet/in.h>
+#include <array>
 #include <filesystem>
 #include <map>
 #include <memory>
+#include <memory_resource>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
 
 namespace vrc_photo_album2::meta_tool {
 
 namespace filesystem = std::filesystem;
 
-typedef struct {
+struct user_entry {
+  std::string_view name;
+  std::optional<std::string_view> screen_name;
+};
+
+// 文字列はarena上に置いてviewで持つ ユーザーは名前順に並べた配列
+// upstreamにバッチ単位のarenaを渡すと複数ファイルで領域を共有できる
+class meta_record {
+private:
+  // 小さいメタデータはヒープを使わずに収まるようにする
+  std::array<char, 4096> initial_;
+  std::pmr::monotonic_buffer_resource arena_;
+
+public:
+  meta_record(std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+  meta_record(const meta_record&) = delete;
+  meta_record& operator=(const meta_record&) = delete;
+  char* allocate(std::size_t size);
+  std::string_view store(std::string_view str);
+  // userはarena上の文字列であること
+  void add_user(std::string_view user);
+  void delete_user(std::string_view user_name);
+  void clear_users();
+  void clear();
+
   // TODO: clang++でchrono::local_seconds周りの実装が充実してきたらこっちにする
-  std::optional<std::string> date;
-  std::optional<std::string> photographer;
-  std::optional<std::string> world;
-  std::map<std::string, std::optional<std::string>> users;
-} meta_data;
+  std::optional<std::string_view> date;
+  std::optional<std::string_view> photographer;
+  std::optional<std::string_view> world;
+  std::pmr::vector<user_entry> users;
+};
 
 struct header {
   uint32_t size;
@@ -37,17 +66,19 @@ public:
 class chunk_util {
 public:
   chunk_util(filesystem::path path);
-  decltype(auto) read();
-  // decltype(auto) write();
-  // decltype(auto) create_chunk();
+  void read(meta_record& record);
+  void write(const std::vector<std::tuple<std::string, std::string>>& chunks);
+  static std::string create_chunk(std::string_view type, std::string_view data);
 
 private:
   decltype(auto) parse_chunk(chunk_s& chunk);
+  static bool is_meta_chunk(const char* type);
   filesystem::path path_;
 };
 
 class meta_tool {
 public:
+  meta_tool(std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
   std::string date() const;
   std::string readable_date() const;
   std::string photographer() const;
@@ -59,18 +90,20 @@ public:
   bool has_photographer() const;
   bool has_world() const;
   bool has_users() const;
-  // decltype(auto) users_begin() const;
-  // decltype(auto) users_end() const;
-  void set_date(std::optional<std::string> date);
-  void set_photographer(std::optional<std::string> photographer);
-  void set_world(std::optional<std::string> world);
-  void add_user(std::string user);
-  void delete_user(std::string user_name);
+  std::size_t user_count() const;
+  std::pmr::vector<user_entry>::const_iterator users_begin() const;
+  std::pmr::vector<user_entry>::const_iterator users_end() const;
+  void set_date(std::optional<std::string_view> date);
+  void set_photographer(std::optional<std::string_view> photographer);
+  void set_world(std::optional<std::string_view> world);
+  void add_user(std::string_view user);
+  void delete_user(std::string_view user_name);
   void clear_users();
   void read(filesystem::path path);
+  void write(filesystem::path path) const;
 
 private:
-  meta_data data_;
+  meta_record data_;
 };
 } // namespace vrc_photo_album2::meta_tool
 #endif